@@ -4,6 +4,7 @@
 #include <gtk/gtk.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <termios.h>
 #include <fcntl.h>
 
@@ -14,10 +15,28 @@
 #define MAXCOLS (20)    // Display has 20 characters per line
 #define MAXROWS (4)     // IEE/BA66 displays have four rows, BA63 has two
 #define MAXNAME (16)    // Max length of name of a preset
+#define MAXDEPTH (16)   // Max nesting of traced callbacks
+#define MAXSTALLS (10)  // Number of worst stalls reported at exit
+#define MAXSEQ  (512)   // Max length of an encoded screen update
+#define MAXPARTIAL (10) // Max updates before a full redraw
 
 #define DISPLAY_BA63    (1)
 #define DISPLAY_BA66    (2)
 #define DISPLAY_IEE     (3)
+#define NDISPLAYS       (4)
+
+#define ALIGN_LEFT      (0)
+#define ALIGN_CENTRE    (1)
+#define ALIGN_RIGHT     (2)
+
+#define WRAP_NONE       (0)   // Each text field is one row on the display
+#define WRAP_WORD       (1)   // Fill each row with as many words as will fit
+#define WRAP_FIT        (2)   // Spread the words evenly over all the rows
+
+#define MOVE_HOME       (0)
+#define MOVE_CR         (1)
+#define MOVE_RIGHT      (2)
+#define MOVE_CUP        (3)
 
 #define LUG_PRESET      (1)
 #define MFUK_PRESET     (2)
@@ -33,6 +52,8 @@ struct Item {
    int which;
    GtkEntry *entry[MAXROWS];
    GtkButton *button;
+   GtkComboBox *align;
+   GtkComboBox *wrap;
 };
 
 struct PresetButton {
@@ -41,7 +62,71 @@ struct PresetButton {
    GtkButton *button;
 };
 
+struct Layout {
+   int align;
+   int wrap;
+};
+
+struct MessageBank {
+   char text[MAXMSGS][MAXROWS][MAXCOLS + 1];
+   struct Layout layout[MAXMSGS];
+   unsigned int serial[MAXMSGS];   // Changes whenever text or layout changes
+};
+
+struct LayoutCache {
+   int valid;
+   unsigned int serial;
+   char cell[MAXROWS][MAXCOLS + 1];
+};
+
+/* Command set of each type of display. The cost of each command is
+   simply its length in bytes, since the serial line is the bottleneck */
+struct DisplayModel {
+   const char *name;
+   int rows;
+   int dally;          // Needs a pause part-way through a screenful
+   const char *home;
+   const char *cls;
+   const char *eol;    // Clear to end of line, or NULL if not available
+   const char *erase;  // Clear the whole line, or NULL
+   const char *cup;    // Format for absolute cursor position, or NULL
+};
+
+/* Emulated state of the display */
+struct Screen {
+   char cell[MAXROWS][MAXCOLS];
+   int row;
+   int col;
+   int lost;     // Cursor position is not known
+   int bad;      // Contents of the screen are not known
+};
+
+struct Encoder {
+   struct Screen scr;   // State of the display after sending 'buf'
+   char buf[MAXSEQ];
+   int len;
+   int split;           // Where to pause for a slow display, or zero
+};
+
+struct TraceFrame {
+   const char *name;
+   gint64 start;
+   gint64 io;      // Microseconds spent in serial writes
+   gint64 sleep;   // Microseconds spent sleeping
+};
+
+struct TraceStall {
+   const char *name;
+   gint64 duration;
+   gint64 io;
+   gint64 sleep;
+};
+
 struct Item Message[MAXMSGS];
+struct MessageBank Bank[2];   // Front bank is live, back bank is filled by presets
+int Frontbank = 0;
+struct LayoutCache Cache[MAXMSGS][NDISPLAYS];
+unsigned int Serial = 0;
 struct PresetButton Preset[] = {
    {MFUK_PRESET,     "MFUK",     NULL},
    {BRISTOL_PRESET,  "Bristol",  NULL},
@@ -52,11 +137,28 @@ struct PresetButton Preset[] = {
    {MEME_PRESET,     "Memes",    NULL},
    {0,               "",         NULL}
 };
+struct DisplayModel Model[NDISPLAYS] = {
+   {"",     0, FALSE, NULL,     NULL,      NULL,      NULL,      NULL},
+   {"BA63", 2, FALSE, "\x1b[H", "\x1b[2J", "\x1b[0K", "\x1b[2K", "\x1b[%d;%dH"},
+   {"BA66", 4, FALSE, "\x1b[H", "\x1b[2J", "\x1b[0K", "\x1b[2K", "\x1b[%d;%dH"},
+   {"IEE",  4, TRUE,  "\x1b[H", "\x1b[2J", NULL,      NULL,      NULL}
+};
+struct Screen Shadow;
+long int Sentbytes = 0;
+long int Fullbytes = 0;
+int Partial = 0;
 int Curmsg = 0;
 int Autoadvance = FALSE;
 int DisplayType = DISPLAY_BA63;
 GtkSpinButton *Time_spin;
 GtkToggleButton *Auto_button;
+FILE *Tracefp = NULL;
+gint64 Traceorigin = 0;
+int Tracedepth = 0;
+int Traceevents = 0;
+struct TraceFrame Traceframe[MAXDEPTH];
+struct TraceStall Stall[MAXSTALLS];
+int Nstalls = 0;
 
 
 static int openSerialPort(const char *const port, const int baud)
@@ -103,12 +205,291 @@ static int openSerialPort(const char *const port, const int baud)
 }
 
 
-void ba63send(const char *const str)
+/* trace_open --- start writing a trace file in Chrome JSON format */
+
+static void trace_open(const char *const fname)
 {
-   const int n = strlen(str);
-   
-   if (write(Fd, str, n) != n)
+   if ((Tracefp = fopen(fname, "w")) == NULL) {
+      perror(fname);
+      exit(1);
+   }
+
+   fprintf(Tracefp, "[\n");
+
+   Traceorigin = g_get_monotonic_time();
+}
+
+
+/* trace_now --- return a timestamp if tracing, otherwise zero */
+
+static gint64 trace_now(void)
+{
+   if (Tracefp)
+      return (g_get_monotonic_time());
+   else
+      return (0);
+}
+
+
+/* trace_event --- write one complete event to the trace file */
+
+static void trace_event(const char *const name, const char *const cat, const gint64 start, const gint64 dur, const char *const args)
+{
+   fprintf(Tracefp, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%lld,\"dur\":%lld,\"args\":{%s}}",
+           (Traceevents++ > 0) ? ",\n" : "", name, cat,
+           (long long)(start - Traceorigin), (long long)dur, args);
+}
+
+
+/* trace_enter --- note entry to a GTK callback */
+
+static void trace_enter(const char *const name)
+{
+   if (Tracefp == NULL)
+      return;
+
+   if (Tracedepth < MAXDEPTH) {
+      Traceframe[Tracedepth].name = name;
+      Traceframe[Tracedepth].start = g_get_monotonic_time();
+      Traceframe[Tracedepth].io = 0;
+      Traceframe[Tracedepth].sleep = 0;
+   }
+
+   Tracedepth++;
+}
+
+
+/* trace_exit --- note exit from a GTK callback and keep the worst stalls */
+
+static void trace_exit(void)
+{
+   struct TraceFrame *f;
+   gint64 dur;
+   char args[64];
+   int i;
+
+   if ((Tracefp == NULL) || (Tracedepth == 0))
+      return;
+
+   if (--Tracedepth >= MAXDEPTH)
+      return;
+
+   f = &Traceframe[Tracedepth];
+   dur = g_get_monotonic_time() - f->start;
+
+   sprintf(args, "\"io_us\":%lld,\"sleep_us\":%lld", (long long)f->io, (long long)f->sleep);
+   trace_event(f->name, "callback", f->start, dur, args);
+
+   if (Tracedepth > 0) {
+      /* Nested callback, e.g. a radio button toggled from timer_callback */
+      Traceframe[Tracedepth - 1].io += f->io;
+      Traceframe[Tracedepth - 1].sleep += f->sleep;
+      return;
+   }
+
+   /* Insert into the list of worst stalls, longest first */
+   for (i = Nstalls; (i > 0) && (Stall[i - 1].duration < dur); i--)
+      if (i < MAXSTALLS)
+         Stall[i] = Stall[i - 1];
+
+   if (i < MAXSTALLS) {
+      Stall[i].name = f->name;
+      Stall[i].duration = dur;
+      Stall[i].io = f->io;
+      Stall[i].sleep = f->sleep;
+
+      if (Nstalls < MAXSTALLS)
+         Nstalls++;
+   }
+}
+
+
+/* trace_io --- note time spent writing to the serial port */
+
+static void trace_io(const gint64 start, const int nbytes)
+{
+   const gint64 dur = g_get_monotonic_time() - start;
+   char args[32];
+
+   sprintf(args, "\"bytes\":%d", nbytes);
+   trace_event("write", "io", start, dur, args);
+
+   if ((Tracedepth > 0) && (Tracedepth <= MAXDEPTH))
+      Traceframe[Tracedepth - 1].io += dur;
+}
+
+
+/* trace_sleep --- note time spent sleeping */
+
+static void trace_sleep(const gint64 start)
+{
+   const gint64 dur = g_get_monotonic_time() - start;
+
+   trace_event("nanosleep", "sleep", start, dur, "");
+
+   if ((Tracedepth > 0) && (Tracedepth <= MAXDEPTH))
+      Traceframe[Tracedepth - 1].sleep += dur;
+}
+
+
+/* trace_close --- finish the trace file and summarise the worst stalls */
+
+static void trace_close(void)
+{
+   int i;
+
+   if (Tracefp == NULL)
+      return;
+
+   fprintf(Tracefp, "\n]\n");
+   fclose(Tracefp);
+   Tracefp = NULL;
+
+   fprintf(stderr, "Worst main-loop stalls:\n");
+   fprintf(stderr, "   total ms  serial ms   sleep ms  callback\n");
+
+   for (i = 0; i < Nstalls; i++)
+      fprintf(stderr, "%11.1f%11.1f%11.1f  %s\n", Stall[i].duration / 1000.0,
+              Stall[i].io / 1000.0, Stall[i].sleep / 1000.0, Stall[i].name);
+}
+
+
+/* screen_reset --- mark the emulated display as unknown */
+
+static void screen_reset(struct Screen *scr)
+{
+   memset(scr->cell, ' ', sizeof (scr->cell));
+   scr->row = 0;
+   scr->col = 0;
+   scr->lost = TRUE;
+   scr->bad = TRUE;
+}
+
+
+/* screen_feed --- emulate the effect of a sequence of bytes on the display */
+
+static void screen_feed(struct Screen *scr, const struct DisplayModel *model, const char *const buf, const int n)
+{
+   int param[2];
+   int np;
+   int i = 0;
+
+   while (i < n) {
+      const unsigned char ch = buf[i++];
+
+      if (ch == ESC) {
+         if ((i < n) && (buf[i] == 'R')) {   // Select national character set
+            i += 2;
+
+            if (i > n)
+               scr->bad = TRUE;
+
+            continue;
+         }
+
+         if ((i >= n) || (buf[i] != '[')) {
+            scr->bad = TRUE;
+            continue;
+         }
+
+         param[0] = param[1] = 0;
+         np = 0;
+
+         for (i++; (i < n) && (isdigit((unsigned char)buf[i]) || (buf[i] == ';')); i++) {
+            if (np == 0)
+               np = 1;
+
+            if (buf[i] == ';')
+               np++;
+            else if (np <= 2)
+               param[np - 1] = (param[np - 1] * 10) + buf[i] - '0';
+         }
+
+         if ((i >= n) || (np > 2)) {
+            scr->bad = TRUE;
+            break;
+         }
+
+         switch (buf[i++]) {
+         case 'H':
+            if (np == 0) {
+               scr->row = 0;
+               scr->col = 0;
+               scr->lost = FALSE;
+            }
+            else if ((model->cup != NULL) && (param[0] >= 1) && (param[0] <= model->rows) &&
+                     (param[1] <= MAXCOLS)) {
+               scr->row = param[0] - 1;
+               scr->col = (param[1] > 0) ? param[1] - 1 : 0;
+               scr->lost = FALSE;
+            }
+            else
+               scr->bad = TRUE;
+            break;
+         case 'J':
+            if (param[0] == 2) {
+               memset(scr->cell, ' ', sizeof (scr->cell));
+               scr->bad = FALSE;
+            }
+            else
+               scr->bad = TRUE;
+            break;
+         case 'K':
+            if ((model->eol != NULL) && (param[0] == 0) && !scr->lost)
+               memset(&scr->cell[scr->row][scr->col], ' ', MAXCOLS - scr->col);
+            else if ((model->erase != NULL) && (param[0] == 2) && !scr->lost)
+               memset(scr->cell[scr->row], ' ', MAXCOLS);
+            else
+               scr->bad = TRUE;
+            break;
+         default:
+            scr->bad = TRUE;
+            break;
+         }
+      }
+      else if (ch == '\r') {
+         scr->col = 0;
+      }
+      else if (ch == '\n') {
+         if (!scr->lost && (++scr->row >= model->rows)) {
+            /* Display may scroll, so neither contents nor cursor are known */
+            scr->row = model->rows - 1;
+            scr->lost = TRUE;
+            scr->bad = TRUE;
+         }
+      }
+      else if ((ch >= ' ') && !scr->lost) {
+         scr->cell[scr->row][scr->col++] = ch;
+
+         /* The display may or may not wrap onto the next row */
+         if (scr->col >= MAXCOLS)
+            scr->lost = TRUE;
+      }
+      else
+         scr->bad = TRUE;
+   }
+}
+
+
+void ba63write(const char *const buf, const int n)
+{
+   const gint64 t = trace_now();
+
+   if (write(Fd, buf, n) != n) {
       perror("write");
+      screen_reset(&Shadow);   // Force a full redraw next time
+   }
+   else
+      screen_feed(&Shadow, &Model[DisplayType], buf, n);
+
+   if (Tracefp)
+      trace_io(t, n);
+}
+
+
+void ba63send(const char *const str)
+{
+   ba63write(str, strlen(str));
 }
 
 
@@ -126,8 +507,7 @@ void ba63charset(const int countryCode)
    str[1] = 'R';
    str[2] = countryCode;
    
-   if (write(Fd, str, 3) != 3) // Select national character set
-      perror("write");
+   ba63write(str, 3);   // Select national character set
 }
 
 
@@ -137,10 +517,27 @@ void ba63home(void)
 }
 
 
+/* ieedally --- give the IEE display time to catch up */
+
+void ieedally(void)
+{
+   struct timespec dally;
+   const gint64 t = trace_now();
+
+   dally.tv_sec = 0;
+   dally.tv_nsec = 100000000L;
+
+   nanosleep(&dally, NULL);
+
+   if (Tracefp)
+      trace_sleep(t);
+}
+
+
 int isBlank(const int msg)
 {
-   const char *str1 = gtk_entry_get_text(Message[msg].entry[0]);
-   const char *str2 = gtk_entry_get_text(Message[msg].entry[1]);
+   const char *str1 = Bank[Frontbank].text[msg][0];
+   const char *str2 = Bank[Frontbank].text[msg][1];
    
    return ((*str1 == '\0') && (*str2 == '\0'));
 }
@@ -164,45 +561,487 @@ void show_next(void)
 
 static gboolean timer_callback(gpointer data)
 {
+   gboolean again = FALSE;
+
+   trace_enter(__func__);
+
    if (Autoadvance) {
       show_next();
-      return (TRUE);
+      again = TRUE;
    }
-   else
-      return (FALSE);
+
+   trace_exit();
+
+   return (again);
 }
 
 
-/* show_message --- show two or four text strings on the display */
+/* display_rows --- return the number of rows on a type of display */
 
-void show_message(const int i)
+static int display_rows(const int type)
 {
-   const char *str1 = gtk_entry_get_text(Message[i].entry[0]);
-   const char *str2 = gtk_entry_get_text(Message[i].entry[1]);
-   const char *str3 = gtk_entry_get_text(Message[i].entry[2]);
-   const char *str4 = gtk_entry_get_text(Message[i].entry[3]);
+   return (Model[type].rows);
+}
 
-   ba63home();
-   ba63cls();
 
-   ba63send(str1);
-   ba63send("\r\n");
-   ba63send(str2);
-   if ((DisplayType == DISPLAY_BA66) || (DisplayType == DISPLAY_IEE)) {
-      if (DisplayType == DISPLAY_IEE) {
-         struct timespec dally;
-         
-         dally.tv_sec = 0;
-         dally.tv_nsec = 100000000L;
-         
-         nanosleep(&dally, NULL);
+/* wrap_words --- break a list of words into rows no wider than 'width' */
+
+static int wrap_words(char *const word[], const int nwords, const int width, char row[][MAXCOLS + 1], const int maxrows)
+{
+   int nrows = 0;
+   int len = 0;
+   int w;
+
+   for (w = 0; w < nwords; w++) {
+      const int wlen = strlen(word[w]);
+
+      if ((nrows > 0) && (len + 1 + wlen <= width)) {
+         if (nrows <= maxrows) {
+            strcat(row[nrows - 1], " ");
+            strcat(row[nrows - 1], word[w]);
+         }
+
+         len += 1 + wlen;
+      }
+      else {
+         nrows++;
+
+         if (nrows <= maxrows)
+            strcpy(row[nrows - 1], word[w]);
+
+         len = wlen;
       }
-      
-      ba63send("\r\n");
-      ba63send(str3);
-      ba63send("\r\n");
-      ba63send(str4);
    }
+
+   return (nrows);
+}
+
+
+/* layout_message --- make the grid of cells for a message on this display */
+
+static const struct LayoutCache *layout_message(const int msg)
+{
+   const struct MessageBank *const bank = &Bank[Frontbank];
+   const struct Layout *const policy = &bank->layout[msg];
+   struct LayoutCache *const cache = &Cache[msg][DisplayType];
+   char row[MAXROWS][MAXCOLS + 1];
+   char text[(MAXROWS * (MAXCOLS + 1)) + 1];
+   char *word[(MAXROWS * (MAXCOLS + 1)) / 2];
+   char *tok;
+   int nrows;
+   int nwords;
+   int width;
+   int len;
+   int pad;
+   int i;
+
+   if (cache->valid && (cache->serial == bank->serial[msg]))
+      return (cache);
+
+   nrows = display_rows(DisplayType);
+
+   memset(row, 0, sizeof (row));
+
+   if (policy->wrap == WRAP_NONE) {
+      for (i = 0; i < nrows; i++) {
+         const char *str = bank->text[msg][i];
+
+         /* Leading spaces are kept only when the text is left-aligned */
+         if (policy->align != ALIGN_LEFT)
+            while (*str == ' ')
+               str++;
+
+         strcpy(row[i], str);
+
+         for (len = strlen(row[i]); (len > 0) && (row[i][len - 1] == ' '); len--)
+            row[i][len - 1] = '\0';
+      }
+   }
+   else {
+      text[0] = '\0';
+
+      for (i = 0; i < MAXROWS; i++) {
+         strcat(text, bank->text[msg][i]);
+         strcat(text, " ");
+      }
+
+      nwords = 0;
+      width = 1;
+
+      for (tok = strtok(text, " "); tok != NULL; tok = strtok(NULL, " ")) {
+         word[nwords++] = tok;
+
+         if (strlen(tok) > width)
+            width = strlen(tok);
+      }
+
+      if (policy->wrap == WRAP_WORD)
+         width = MAXCOLS;
+      else
+         while ((width < MAXCOLS) && (wrap_words(word, nwords, width, NULL, 0) > nrows))
+            width++;
+
+      wrap_words(word, nwords, width, row, nrows);
+   }
+
+   for (i = 0; i < MAXROWS; i++) {
+      len = strlen(row[i]);
+
+      switch (policy->align) {
+      case ALIGN_CENTRE:
+         pad = (MAXCOLS - len) / 2;
+         break;
+      case ALIGN_RIGHT:
+         pad = MAXCOLS - len;
+         break;
+      default:
+         pad = 0;
+         break;
+      }
+
+      memset(cache->cell[i], ' ', MAXCOLS);
+      memcpy(cache->cell[i] + pad, row[i], len);
+      cache->cell[i][MAXCOLS] = '\0';
+   }
+
+   cache->serial = bank->serial[msg];
+   cache->valid = TRUE;
+
+   return (cache);
+}
+
+
+/* encode_bytes --- add bytes to an encoded update, tracking their effect */
+
+static void encode_bytes(struct Encoder *enc, const char *const str, const int n)
+{
+   if (enc->len + n > MAXSEQ) {
+      enc->scr.bad = TRUE;
+      return;
+   }
+
+   memcpy(enc->buf + enc->len, str, n);
+   enc->len += n;
+
+   screen_feed(&enc->scr, &Model[DisplayType], str, n);
+}
+
+
+/* encode_str --- add a command string to an encoded update */
+
+static void encode_str(struct Encoder *enc, const char *const str)
+{
+   encode_bytes(enc, str, strlen(str));
+}
+
+
+/* move_cost --- find the cheapest way to move the cursor */
+
+static int move_cost(const struct Encoder *enc, const int row, const int col, int *how)
+{
+   const struct DisplayModel *const model = &Model[DisplayType];
+   const struct Screen *const scr = &enc->scr;
+   char cup[16];
+   int best;
+   int cost;
+
+   /* Home, then line feeds, then re-type the start of the row */
+   best = strlen(model->home) + row + col;
+   *how = MOVE_HOME;
+
+   if (!scr->lost && (scr->row <= row)) {
+      cost = 1 + (row - scr->row) + col;
+
+      if (cost < best) {
+         best = cost;
+         *how = MOVE_CR;
+      }
+
+      /* Re-type the characters between the cursor and the target */
+      if ((scr->row == row) && (scr->col <= col)) {
+         cost = col - scr->col;
+
+         if (cost < best) {
+            best = cost;
+            *how = MOVE_RIGHT;
+         }
+      }
+   }
+
+   if (model->cup != NULL) {
+      cost = sprintf(cup, model->cup, row + 1, col + 1);
+
+      if (cost < best) {
+         best = cost;
+         *how = MOVE_CUP;
+      }
+   }
+
+   return (best);
+}
+
+
+/* encode_move --- move the cursor, re-typing from 'target' if need be */
+
+static void encode_move(struct Encoder *enc, const int row, const int col, const char *const target)
+{
+   const struct DisplayModel *const model = &Model[DisplayType];
+   char cup[16];
+   int how;
+   int n;
+
+   move_cost(enc, row, col, &how);
+
+   switch (how) {
+   case MOVE_HOME:
+      encode_str(enc, model->home);
+
+      for (n = 0; n < row; n++)
+         encode_str(enc, "\n");
+
+      encode_bytes(enc, target, col);
+      break;
+   case MOVE_CR:
+      n = row - enc->scr.row;
+
+      encode_str(enc, "\r");
+
+      while (n-- > 0)
+         encode_str(enc, "\n");
+
+      encode_bytes(enc, target, col);
+      break;
+   case MOVE_RIGHT:
+      encode_bytes(enc, target + enc->scr.col, col - enc->scr.col);
+      break;
+   case MOVE_CUP:
+      n = sprintf(cup, model->cup, row + 1, col + 1);
+      encode_bytes(enc, cup, n);
+      break;
+   }
+}
+
+
+/* encode_row --- bring one row of the display up to date */
+
+static void encode_row(struct Encoder *enc, const char *const target, const int row, const int useEol)
+{
+   int tail = MAXCOLS;
+   int best;
+   int cost;
+   int least;
+   int how;
+   int c, x;
+
+   /* Characters from 'tail' onwards are cleared in one go */
+   if (useEol)
+      while ((tail > 0) && (target[tail - 1] == ' '))
+         tail--;
+
+   for (c = 0; c < tail; c++) {
+      if (enc->scr.cell[row][c] != target[c]) {
+         encode_move(enc, row, c, target);
+         encode_bytes(enc, &target[c], 1);
+      }
+   }
+
+   if (useEol) {
+      for (x = tail; (x < MAXCOLS) && (enc->scr.cell[row][x] == target[x]); x++)
+         ;
+
+      if (x < MAXCOLS) {
+         /* Clearing from anywhere between 'tail' and 'x' will do */
+         best = x;
+         least = move_cost(enc, row, x, &how);
+
+         for (c = tail; c < x; c++) {
+            if ((cost = move_cost(enc, row, c, &how)) < least) {
+               best = c;
+               least = cost;
+            }
+         }
+
+         encode_move(enc, row, best, target);
+         encode_str(enc, Model[DisplayType].eol);
+      }
+   }
+}
+
+
+/* encode_erase --- clear a whole row from wherever is cheapest to reach */
+
+static void encode_erase(struct Encoder *enc, const char *const target, const int row)
+{
+   int best = 0;
+   int least;
+   int cost;
+   int how;
+   int c;
+
+   least = move_cost(enc, row, 0, &how);
+
+   for (c = 1; c < MAXCOLS; c++) {
+      if ((cost = move_cost(enc, row, c, &how)) < least) {
+         best = c;
+         least = cost;
+      }
+   }
+
+   encode_move(enc, row, best, target);
+   encode_str(enc, Model[DisplayType].erase);
+}
+
+
+/* encode_rows --- bring all rows of the display up to date */
+
+static void encode_rows(struct Encoder *enc, const struct LayoutCache *grid, const int nrows)
+{
+   struct Encoder plain;
+   struct Encoder clear;
+   struct Encoder erase;
+   int r;
+
+   for (r = 0; r < nrows; r++) {
+      if (r == 2)
+         enc->split = enc->len;
+
+      if (memcmp(enc->scr.cell[r], grid->cell[r], MAXCOLS) == 0)
+         continue;
+
+      plain = *enc;
+      encode_row(&plain, grid->cell[r], r, FALSE);
+
+      if (Model[DisplayType].eol != NULL) {
+         clear = *enc;
+         encode_row(&clear, grid->cell[r], r, TRUE);
+
+         if (clear.len < plain.len)
+            plain = clear;
+      }
+
+      /* Clear the whole row, then type in just the non-blank characters */
+      if (Model[DisplayType].erase != NULL) {
+         erase = *enc;
+         encode_erase(&erase, grid->cell[r], r);
+         encode_row(&erase, grid->cell[r], r, FALSE);
+
+         if (erase.len < plain.len)
+            plain = erase;
+      }
+
+      *enc = plain;
+   }
+}
+
+
+/* encode_full --- encode a complete redraw of the display */
+
+static void encode_full(struct Encoder *enc, const struct LayoutCache *grid, const int nrows)
+{
+   int r;
+   int n;
+
+   enc->scr = Shadow;
+   enc->len = 0;
+   enc->split = 0;
+
+   encode_str(enc, Model[DisplayType].home);
+   encode_str(enc, Model[DisplayType].cls);
+
+   for (r = 0; r < nrows; r++) {
+      if (r == 2)
+         enc->split = enc->len;
+
+      if (r > 0)
+         encode_str(enc, "\r\n");
+
+      for (n = MAXCOLS; (n > 0) && (grid->cell[r][n - 1] == ' '); n--)
+         ;
+
+      encode_bytes(enc, grid->cell[r], n);
+   }
+}
+
+
+/* encode_update --- find the shortest sequence to get from Shadow to 'grid' */
+
+static void encode_update(struct Encoder *enc, const struct LayoutCache *grid, const int nrows)
+{
+   struct Encoder redraw;
+
+   enc->scr = Shadow;
+   enc->len = 0;
+   enc->split = 0;
+
+   /* Either clear the screen and start again... */
+   redraw = *enc;
+   encode_str(&redraw, Model[DisplayType].home);
+   encode_str(&redraw, Model[DisplayType].cls);
+   encode_rows(&redraw, grid, nrows);
+
+   /* ...or just change what's different */
+   if (Shadow.bad)
+      *enc = redraw;
+   else {
+      encode_rows(enc, grid, nrows);
+
+      if (redraw.len < enc->len)
+         *enc = redraw;
+   }
+}
+
+
+/* encode_send --- send an encoded update, pausing if the display needs it */
+
+static void encode_send(const struct Encoder *enc)
+{
+   if (Model[DisplayType].dally && (enc->split > 0) && (enc->split < enc->len)) {
+      ba63write(enc->buf, enc->split);
+      ieedally();
+      ba63write(enc->buf + enc->split, enc->len - enc->split);
+   }
+   else
+      ba63write(enc->buf, enc->len);
+}
+
+
+/* encode_message --- encode the update needed to show a message */
+
+static void encode_message(const int i, struct Encoder *enc)
+{
+   const struct LayoutCache *const grid = layout_message(i);
+   const int nrows = display_rows(DisplayType);
+   struct Encoder full;
+
+   /* We can't see line noise or a power cycle, so redraw now and then */
+   if (++Partial >= MAXPARTIAL)
+      screen_reset(&Shadow);
+
+   if (Shadow.bad)
+      Partial = 0;
+
+   encode_full(&full, grid, nrows);
+   encode_update(enc, grid, nrows);
+
+   /* Ran out of room, or used a command that this display doesn't have */
+   if (enc->scr.bad) {
+      g_printerr("ba63gui: encoded update is not usable, sending full redraw\n");
+      *enc = full;
+   }
+
+   Sentbytes += enc->len;
+   Fullbytes += full.len;
+}
+
+
+/* show_message --- show two or four rows of a message on the display */
+
+void show_message(const int i)
+{
+   struct Encoder enc;
+
+   encode_message(i, &enc);
+   encode_send(&enc);
 }
 
 
@@ -213,6 +1052,8 @@ static void show_button(GtkWidget *widget, gpointer data)
    const struct Item *p = (const struct Item *)data;
    const int i = p->which;
 
+   trace_enter(__func__);
+
    if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget))) {
 //    g_print("Show button %d was pressed\n", i);
       show_message(i);
@@ -221,6 +1062,8 @@ static void show_button(GtkWidget *widget, gpointer data)
    else {
 //    g_print("Show button %d was released\n", i);
    }
+
+   trace_exit();
 }
 
 
@@ -228,6 +1071,8 @@ static void show_button(GtkWidget *widget, gpointer data)
 
 static void auto_button(GtkWidget *widget, gpointer data)
 {
+   trace_enter(__func__);
+
    if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget))) {
 //    g_print("Auto button was pressed\n");
 
@@ -246,6 +1091,8 @@ static void auto_button(GtkWidget *widget, gpointer data)
 //    g_print("Auto button was released\n");
       Autoadvance = FALSE;
    }
+
+   trace_exit();
 }
 
 
@@ -258,6 +1105,8 @@ static void test_button(GtkWidget *widget, gpointer data)
    
 // g_print("Test button was pressed\n");
 
+   trace_enter(__func__);
+
    gtk_toggle_button_set_active(Auto_button, FALSE);
 
    for (i = 0; i < MAXCOLS; i++)
@@ -271,20 +1120,16 @@ static void test_button(GtkWidget *widget, gpointer data)
    ba63send("\r\n");
    ba63send(str);
    if ((DisplayType == DISPLAY_BA66) || (DisplayType == DISPLAY_IEE)) {
-      if (DisplayType == DISPLAY_IEE) {
-         struct timespec dally;
-         
-         dally.tv_sec = 0;
-         dally.tv_nsec = 100000000L;
-         
-         nanosleep(&dally, NULL);
-      }
+      if (DisplayType == DISPLAY_IEE)
+         ieedally();
 
       ba63send("\r\n");
       ba63send(str);
       ba63send("\r\n");
       ba63send(str);
    }
+
+   trace_exit();
 }
 
 
@@ -294,10 +1139,14 @@ static void clear_button(GtkWidget *widget, gpointer data)
 {
 // g_print("Clear button was pressed\n");
 
+   trace_enter(__func__);
+
    gtk_toggle_button_set_active(Auto_button, FALSE);
 
    ba63home();
    ba63cls();
+
+   trace_exit();
 }
 
 
@@ -307,134 +1156,231 @@ static void next_button(GtkWidget *widget, gpointer data)
 {
 // g_print("Manual Next button was pressed\n");
 
+   trace_enter(__func__);
+
    show_next();
+
+   trace_exit();
 }
 
 
-/* preset_click --- fill in text fields with pre-set strings */
+/* entry_changed --- copy edited text into the front bank */
 
-static void preset_click(GtkWidget *widget, gpointer data)
+static void entry_changed(GtkEditable *editable, gpointer data)
 {
-   const struct PresetButton *const p = (const struct PresetButton *const)data;
-   int i;
+   const struct Item *p = (const struct Item *)data;
+   int j;
 
-// g_print ("Preset button %d was clicked\n", p->which);
+   trace_enter(__func__);
+
+   for (j = 0; j < MAXROWS; j++)
+      if (GTK_EDITABLE(p->entry[j]) == editable)
+         g_strlcpy(Bank[Frontbank].text[p->which][j], gtk_entry_get_text(p->entry[j]), MAXCOLS + 1);
+
+   Bank[Frontbank].serial[p->which] = ++Serial;
+
+   trace_exit();
+}
+
+
+/* layout_changed --- copy alignment and wrap settings into the front bank */
+
+static void layout_changed(GtkComboBox *combo, gpointer data)
+{
+   const struct Item *p = (const struct Item *)data;
+   struct Layout *const policy = &Bank[Frontbank].layout[p->which];
+
+   trace_enter(__func__);
+
+   policy->align = gtk_combo_box_get_active(p->align);
+   policy->wrap = gtk_combo_box_get_active(p->wrap);
+
+   Bank[Frontbank].serial[p->which] = ++Serial;
+
+   trace_exit();
+}
+
+
+/* bank_set --- set one line of one message in a bank */
+
+static void bank_set(struct MessageBank *bank, const int msg, const int row, const char *const str)
+{
+   g_strlcpy(bank->text[msg][row], str, MAXCOLS + 1);
+}
+
+
+/* bank_layout --- set the alignment and wrap policy of a message in a bank */
+
+static void bank_layout(struct MessageBank *bank, const int msg, const int align, const int wrap)
+{
+   bank->layout[msg].align = align;
+   bank->layout[msg].wrap = wrap;
+}
+
+
+/* refresh_entries --- update all text fields from the front bank in one batch */
+
+static void refresh_entries(GtkWidget *widget)
+{
+   GdkWindow *window = gtk_widget_get_window(gtk_widget_get_toplevel(widget));
+   int i, j;
+
+   if (window)
+      gdk_window_freeze_updates(window);
 
    for (i = 0; i < MAXMSGS; i++) {
-      gtk_entry_set_text(Message[i].entry[2], "");
-      gtk_entry_set_text(Message[i].entry[3], "");
+      for (j = 0; j < MAXROWS; j++) {
+         g_signal_handlers_block_by_func(Message[i].entry[j], G_CALLBACK(entry_changed), &Message[i]);
+         gtk_entry_set_text(Message[i].entry[j], Bank[Frontbank].text[i][j]);
+         g_signal_handlers_unblock_by_func(Message[i].entry[j], G_CALLBACK(entry_changed), &Message[i]);
+      }
+
+      g_signal_handlers_block_by_func(Message[i].align, G_CALLBACK(layout_changed), &Message[i]);
+      g_signal_handlers_block_by_func(Message[i].wrap, G_CALLBACK(layout_changed), &Message[i]);
+      gtk_combo_box_set_active(Message[i].align, Bank[Frontbank].layout[i].align);
+      gtk_combo_box_set_active(Message[i].wrap, Bank[Frontbank].layout[i].wrap);
+      g_signal_handlers_unblock_by_func(Message[i].align, G_CALLBACK(layout_changed), &Message[i]);
+      g_signal_handlers_unblock_by_func(Message[i].wrap, G_CALLBACK(layout_changed), &Message[i]);
    }
 
-   switch (p->which) {
+   if (window)
+      gdk_window_thaw_updates(window);
+}
+
+
+/* preset_fill --- fill in a bank with pre-set strings */
+
+static void preset_fill(struct MessageBank *back, const int which)
+{
+   int i;
+
+   memset(back, 0, sizeof (struct MessageBank));
+
+   switch (which) {
    case LUG_PRESET:
-      gtk_entry_set_text(Message[0].entry[0], "  BRISTOL AND BATH");
-      gtk_entry_set_text(Message[0].entry[1], "  LINUX USER GROUP");
-      gtk_entry_set_text(Message[1].entry[0], "  Bristol and Bath");
-      gtk_entry_set_text(Message[1].entry[1], "  Linux User Group");
-      gtk_entry_set_text(Message[2].entry[0], "");
-      gtk_entry_set_text(Message[2].entry[1], "");
-      gtk_entry_set_text(Message[3].entry[0], "");
-      gtk_entry_set_text(Message[3].entry[1], "");
-      gtk_entry_set_text(Message[4].entry[0], "");
-      gtk_entry_set_text(Message[4].entry[1], "");
-      gtk_entry_set_text(Message[5].entry[0], "");
-      gtk_entry_set_text(Message[5].entry[1], "");
+      bank_set(back, 0, 0, "BRISTOL AND BATH");
+      bank_set(back, 0, 1, "LINUX USER GROUP");
+      bank_layout(back, 0, ALIGN_CENTRE, WRAP_NONE);
+      bank_set(back, 1, 0, "Bristol and Bath");
+      bank_set(back, 1, 1, "Linux User Group");
+      bank_layout(back, 1, ALIGN_CENTRE, WRAP_NONE);
       break;
    case MFUK_PRESET:
-      gtk_entry_set_text(Message[0].entry[0], "   MAKER FAIRE UK");
-      gtk_entry_set_text(Message[0].entry[1], "   NEWCASTLE 2013");
-      gtk_entry_set_text(Message[1].entry[0], "FUN WITH FLAT-BED");
-      gtk_entry_set_text(Message[1].entry[1], "PEN PLOTTERS");
-      gtk_entry_set_text(Message[2].entry[0], "JOHN HONNIBALL");
-      gtk_entry_set_text(Message[2].entry[1], "BRISTOL HACKSPACE");
-      gtk_entry_set_text(Message[3].entry[0], "FUN WITH FLAT-BED");
-      gtk_entry_set_text(Message[3].entry[1], "PEN PLOTTERS");
-      gtk_entry_set_text(Message[4].entry[0], "@anachrocomputer");
-      gtk_entry_set_text(Message[4].entry[1], "   #MakerFaireUK");
-      gtk_entry_set_text(Message[5].entry[0], "");
-      gtk_entry_set_text(Message[5].entry[1], "");
+      bank_set(back, 0, 0, "MAKER FAIRE UK");
+      bank_set(back, 0, 1, "NEWCASTLE 2013");
+      bank_layout(back, 0, ALIGN_CENTRE, WRAP_NONE);
+      bank_set(back, 1, 0, "FUN WITH FLAT-BED");
+      bank_set(back, 1, 1, "PEN PLOTTERS");
+      bank_set(back, 2, 0, "JOHN HONNIBALL");
+      bank_set(back, 2, 1, "BRISTOL HACKSPACE");
+      bank_set(back, 3, 0, "FUN WITH FLAT-BED");
+      bank_set(back, 3, 1, "PEN PLOTTERS");
+      bank_set(back, 4, 0, "@anachrocomputer");
+      bank_set(back, 4, 1, "#MakerFaireUK");
+      bank_layout(back, 4, ALIGN_RIGHT, WRAP_NONE);
       break;
    case BRISTOL_PRESET:
-      gtk_entry_set_text(Message[0].entry[0], "BRISTOL MINI");
-      gtk_entry_set_text(Message[0].entry[1], "MAKER FAIRE 2014");
-      gtk_entry_set_text(Message[1].entry[0], "FUN WITH FLAT-BED");
-      gtk_entry_set_text(Message[1].entry[1], "PEN PLOTTERS");
-      gtk_entry_set_text(Message[2].entry[0], "JOHN HONNIBALL");
-      gtk_entry_set_text(Message[2].entry[1], "BRISTOL HACKSPACE");
-      gtk_entry_set_text(Message[3].entry[0], "FUN WITH FLAT-BED");
-      gtk_entry_set_text(Message[3].entry[1], "PEN PLOTTERS");
-      gtk_entry_set_text(Message[4].entry[0], "@anachrocomputer");
-      gtk_entry_set_text(Message[4].entry[1], "           #bmmf");
-      gtk_entry_set_text(Message[5].entry[0], "");
-      gtk_entry_set_text(Message[5].entry[1], "");
+      bank_set(back, 0, 0, "BRISTOL MINI");
+      bank_set(back, 0, 1, "MAKER FAIRE 2014");
+      bank_set(back, 1, 0, "FUN WITH FLAT-BED");
+      bank_set(back, 1, 1, "PEN PLOTTERS");
+      bank_set(back, 2, 0, "JOHN HONNIBALL");
+      bank_set(back, 2, 1, "BRISTOL HACKSPACE");
+      bank_set(back, 3, 0, "FUN WITH FLAT-BED");
+      bank_set(back, 3, 1, "PEN PLOTTERS");
+      bank_set(back, 4, 0, "@anachrocomputer");
+      bank_set(back, 4, 1, "#bmmf");
+      bank_layout(back, 4, ALIGN_RIGHT, WRAP_NONE);
       break;
    case DMMF_PRESET:
-      gtk_entry_set_text(Message[0].entry[0], "DERBY MINI");
-      gtk_entry_set_text(Message[0].entry[1], "MAKER FAIRE 2014");
-      gtk_entry_set_text(Message[1].entry[0], "FUN WITH FLAT-BED");
-      gtk_entry_set_text(Message[1].entry[1], "PEN PLOTTERS");
-      gtk_entry_set_text(Message[2].entry[0], "JOHN HONNIBALL");
-      gtk_entry_set_text(Message[2].entry[1], "BRISTOL HACKSPACE");
-      gtk_entry_set_text(Message[3].entry[0], "FUN WITH FLAT-BED");
-      gtk_entry_set_text(Message[3].entry[1], "PEN PLOTTERS");
-      gtk_entry_set_text(Message[4].entry[0], "@anachrocomputer");
-      gtk_entry_set_text(Message[4].entry[1], "         #DMMF14");
-      gtk_entry_set_text(Message[5].entry[0], "");
-      gtk_entry_set_text(Message[5].entry[1], "");
+      bank_set(back, 0, 0, "DERBY MINI");
+      bank_set(back, 0, 1, "MAKER FAIRE 2014");
+      bank_set(back, 1, 0, "FUN WITH FLAT-BED");
+      bank_set(back, 1, 1, "PEN PLOTTERS");
+      bank_set(back, 2, 0, "JOHN HONNIBALL");
+      bank_set(back, 2, 1, "BRISTOL HACKSPACE");
+      bank_set(back, 3, 0, "FUN WITH FLAT-BED");
+      bank_set(back, 3, 1, "PEN PLOTTERS");
+      bank_set(back, 4, 0, "@anachrocomputer");
+      bank_set(back, 4, 1, "#DMMF14");
+      bank_layout(back, 4, ALIGN_RIGHT, WRAP_NONE);
       break;
    case BVOS_PRESET:
-      gtk_entry_set_text(Message[0].entry[0], "BRISTOL HACKSPACE");
-      gtk_entry_set_text(Message[0].entry[1], "  BV Studios 2014");
-      gtk_entry_set_text(Message[1].entry[0], "BRISTOL HACKSPACE");
-      gtk_entry_set_text(Message[1].entry[1], "John Honniball");
-      gtk_entry_set_text(Message[2].entry[0], "FUN WITH FLAT-BED");
-      gtk_entry_set_text(Message[2].entry[1], "PEN PLOTTERS");
-      gtk_entry_set_text(Message[3].entry[0], "EARTH DEMOLITION");
-      gtk_entry_set_text(Message[3].entry[1], "SIMULATOR GAME");
-      gtk_entry_set_text(Message[4].entry[0], "@anachrocomputer");
-      gtk_entry_set_text(Message[4].entry[1], "");
-      gtk_entry_set_text(Message[5].entry[0], "");
-      gtk_entry_set_text(Message[5].entry[1], "");
+      bank_set(back, 0, 0, "BRISTOL HACKSPACE");
+      bank_set(back, 0, 1, "BV Studios 2014");
+      bank_layout(back, 0, ALIGN_CENTRE, WRAP_NONE);
+      bank_set(back, 1, 0, "BRISTOL HACKSPACE");
+      bank_set(back, 1, 1, "John Honniball");
+      bank_set(back, 2, 0, "FUN WITH FLAT-BED");
+      bank_set(back, 2, 1, "PEN PLOTTERS");
+      bank_set(back, 3, 0, "EARTH DEMOLITION");
+      bank_set(back, 3, 1, "SIMULATOR GAME");
+      bank_set(back, 4, 0, "@anachrocomputer");
       break;
    case BRIGHTON_PRESET:
-      gtk_entry_set_text(Message[0].entry[0], "BRIGHTON MINI");
-      gtk_entry_set_text(Message[0].entry[1], "MAKER FAIRE 2014");
-      gtk_entry_set_text(Message[1].entry[0], "FUN WITH FLAT-BED");
-      gtk_entry_set_text(Message[1].entry[1], "PEN PLOTTERS");
-      gtk_entry_set_text(Message[2].entry[0], "JOHN HONNIBALL");
-      gtk_entry_set_text(Message[2].entry[1], "BRISTOL HACKSPACE");
-      gtk_entry_set_text(Message[3].entry[0], "FUN WITH FLAT-BED");
-      gtk_entry_set_text(Message[3].entry[1], "PEN PLOTTERS");
-      gtk_entry_set_text(Message[4].entry[0], "@anachrocomputer");
-      gtk_entry_set_text(Message[4].entry[1], "           #bmmf");
-      gtk_entry_set_text(Message[5].entry[0], "");
-      gtk_entry_set_text(Message[5].entry[1], "");
+      bank_set(back, 0, 0, "BRIGHTON MINI");
+      bank_set(back, 0, 1, "MAKER FAIRE 2014");
+      bank_set(back, 1, 0, "FUN WITH FLAT-BED");
+      bank_set(back, 1, 1, "PEN PLOTTERS");
+      bank_set(back, 2, 0, "JOHN HONNIBALL");
+      bank_set(back, 2, 1, "BRISTOL HACKSPACE");
+      bank_set(back, 3, 0, "FUN WITH FLAT-BED");
+      bank_set(back, 3, 1, "PEN PLOTTERS");
+      bank_set(back, 4, 0, "@anachrocomputer");
+      bank_set(back, 4, 1, "#bmmf");
+      bank_layout(back, 4, ALIGN_RIGHT, WRAP_NONE);
       break;
    case MEME_PRESET:
-      gtk_entry_set_text(Message[0].entry[0], "   ALL YOUR BASE");
-      gtk_entry_set_text(Message[0].entry[1], "  ARE BELONG TO US");
-      if ((DisplayType == DISPLAY_BA66) || (DisplayType == DISPLAY_IEE)) {
-         gtk_entry_set_text(Message[1].entry[0], "   FOUR");
-         gtk_entry_set_text(Message[1].entry[1], "    SEASONS");
-         gtk_entry_set_text(Message[1].entry[2], "     TOTAL");
-         gtk_entry_set_text(Message[1].entry[3], "      LANDSCAPING");
-      }
-      else {
-         gtk_entry_set_text(Message[1].entry[0], "   FOUR SEASONS");
-         gtk_entry_set_text(Message[1].entry[1], " TOTAL LANDSCAPING");
-      }
-      gtk_entry_set_text(Message[2].entry[0], "SOON MAY THE");
-      gtk_entry_set_text(Message[2].entry[1], " WELLERMAN COME");
-      gtk_entry_set_text(Message[2].entry[2], "TO BRING US SUGAR");
-      gtk_entry_set_text(Message[2].entry[3], " AND TEA AND RUM");
-      gtk_entry_set_text(Message[3].entry[0], "        EVER");
-      gtk_entry_set_text(Message[3].entry[1], "        GIVEN");
-      gtk_entry_set_text(Message[4].entry[0], "NOTES ARE DISPENSED");
-      gtk_entry_set_text(Message[4].entry[1], " BELOW THE SCANNER");
-      gtk_entry_set_text(Message[5].entry[0], "  UNEXPECTED ITEM");
-      gtk_entry_set_text(Message[5].entry[1], "  IN BAGGING AREA");
+      bank_set(back, 0, 0, "ALL YOUR BASE");
+      bank_set(back, 0, 1, "ARE BELONG TO US");
+      bank_layout(back, 0, ALIGN_CENTRE, WRAP_NONE);
+      bank_set(back, 1, 0, "FOUR SEASONS");
+      bank_set(back, 1, 1, "TOTAL LANDSCAPING");
+      bank_layout(back, 1, ALIGN_CENTRE, WRAP_FIT);
+      bank_set(back, 2, 0, "SOON MAY THE");
+      bank_set(back, 2, 1, "WELLERMAN COME");
+      bank_set(back, 2, 2, "TO BRING US SUGAR");
+      bank_set(back, 2, 3, "AND TEA AND RUM");
+      bank_layout(back, 2, ALIGN_CENTRE, WRAP_NONE);
+      bank_set(back, 3, 0, "EVER");
+      bank_set(back, 3, 1, "GIVEN");
+      bank_layout(back, 3, ALIGN_CENTRE, WRAP_NONE);
+      bank_set(back, 4, 0, "NOTES ARE DISPENSED");
+      bank_set(back, 4, 1, "BELOW THE SCANNER");
+      bank_layout(back, 4, ALIGN_CENTRE, WRAP_NONE);
+      bank_set(back, 5, 0, "UNEXPECTED ITEM");
+      bank_set(back, 5, 1, "IN BAGGING AREA");
+      bank_layout(back, 5, ALIGN_CENTRE, WRAP_NONE);
       break;
    }
+
+   for (i = 0; i < MAXMSGS; i++)
+      back->serial[i] = ++Serial;
+}
+
+
+/* preset_click --- fill in back bank with pre-set strings, then swap */
+
+static void preset_click(GtkWidget *widget, gpointer data)
+{
+   const struct PresetButton *const p = (const struct PresetButton *const)data;
+   struct MessageBank *const back = &Bank[1 - Frontbank];
+
+   trace_enter(__func__);
+
+// g_print ("Preset button %d was clicked\n", p->which);
+
+   preset_fill(back, p->which);
+
+   /* Swap banks in one step so that show_message() never sees a mixture */
+   Frontbank = 1 - Frontbank;
+
+   /* Start the new set of messages with a clean display */
+   screen_reset(&Shadow);
+
+   refresh_entries(widget);
+
+   trace_exit();
 }
 
 
@@ -443,9 +1389,13 @@ static gboolean delete_event(GtkWidget *widget,
                        GdkEvent  *event,
                        gpointer   data)
 {
+   trace_enter(__func__);
+
    gtk_main_quit();
    ba63cls();
 
+   trace_exit();
+
    return (FALSE);
 }
 
@@ -476,7 +1426,9 @@ static void make_message_controls(GtkWidget *grid, const int i, const int col, c
    GtkWidget *radio;
    GtkWidget *hbox;
    GtkWidget *ebox;
+   GtkWidget *pbox;
    GtkWidget *entry;
+   GtkWidget *combo;
    char showtip[32];
    int j;
 #if GTK_CHECK_VERSION(3, 16, 0)
@@ -495,7 +1447,7 @@ static void make_message_controls(GtkWidget *grid, const int i, const int col, c
    mono_font = pango_font_description_from_string("monospace");
 #endif
 
-   /* Make a horizontal box for the two text fields and a button */
+   /* Make a horizontal box for the text fields and buttons */
    hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
 
    gtk_widget_show(hbox);
@@ -526,6 +1478,8 @@ static void make_message_controls(GtkWidget *grid, const int i, const int col, c
       
       Message[i].entry[j] = GTK_ENTRY(entry);
       
+      g_signal_connect(entry, "changed", G_CALLBACK(entry_changed), (gpointer)&Message[i]);
+
       gtk_box_pack_start(GTK_BOX(ebox), entry, TRUE, TRUE, 0);
       
       if (j >= lines)
@@ -534,6 +1488,13 @@ static void make_message_controls(GtkWidget *grid, const int i, const int col, c
       gtk_widget_show(entry);
    }
 
+   /* Make a vertical box for the radio button and layout controls */
+   pbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+
+   gtk_box_pack_start(GTK_BOX(hbox), pbox, TRUE, TRUE, 0);
+
+   gtk_widget_show(pbox);
+
    /* Each message has a "Show" radio button */
    radio = gtk_radio_button_new_with_label_from_widget(group, "Show");
 
@@ -542,13 +1503,213 @@ static void make_message_controls(GtkWidget *grid, const int i, const int col, c
    
    group = GTK_RADIO_BUTTON(radio);
    
-   gtk_box_pack_start(GTK_BOX(hbox), radio, TRUE, TRUE, 0);
+   gtk_box_pack_start(GTK_BOX(pbox), radio, TRUE, TRUE, 0);
 
    g_signal_connect(radio, "clicked", G_CALLBACK(show_button), (gpointer)&Message[i]);
 
    sprintf(showtip, "Show message %d", i + 1);
    gtk_widget_set_tooltip_text(radio, showtip);
    gtk_widget_show(radio);
+
+   /* Drop-down list for text alignment */
+   combo = gtk_combo_box_text_new();
+   gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(combo), "Left");
+   gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(combo), "Centre");
+   gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(combo), "Right");
+   gtk_combo_box_set_active(GTK_COMBO_BOX(combo), ALIGN_LEFT);
+   gtk_widget_set_tooltip_text(combo, "Alignment of text on the display");
+   gtk_box_pack_start(GTK_BOX(pbox), combo, TRUE, TRUE, 0);
+   gtk_widget_show(combo);
+   Message[i].align = GTK_COMBO_BOX(combo);
+
+   /* Drop-down list for word-wrap */
+   combo = gtk_combo_box_text_new();
+   gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(combo), "No wrap");
+   gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(combo), "Word wrap");
+   gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(combo), "Fit rows");
+   gtk_combo_box_set_active(GTK_COMBO_BOX(combo), WRAP_NONE);
+   gtk_widget_set_tooltip_text(combo, "Wrap words onto the display rows");
+   gtk_box_pack_start(GTK_BOX(pbox), combo, TRUE, TRUE, 0);
+   gtk_widget_show(combo);
+   Message[i].wrap = GTK_COMBO_BOX(combo);
+
+   g_signal_connect(Message[i].align, "changed", G_CALLBACK(layout_changed), (gpointer)&Message[i]);
+   g_signal_connect(Message[i].wrap, "changed", G_CALLBACK(layout_changed), (gpointer)&Message[i]);
+}
+
+
+/* check_match --- see if a command string is next in a buffer */
+
+static int check_match(const char *const buf, const int n, const char *const cmd)
+{
+   const int len = (cmd == NULL) ? 0 : strlen(cmd);
+
+   if ((len > 0) && (len <= n) && (memcmp(buf, cmd, len) == 0))
+      return (len);
+   else
+      return (0);
+}
+
+
+/* check_feed --- replay bytes on a simple model of a real display */
+
+/* This is written separately from screen_feed(), so that the encoder can
+   be checked by something other than the emulator that it uses itself.
+   It knows nothing of "lost" cursors. Instead, it is run twice: once for
+   a display that wraps onto the next row after the last column, and once
+   for one that stays on the last column. Any byte that it doesn't expect
+   is a failure */
+
+static int check_feed(char cell[][MAXCOLS], int *row, int *col, const int wrap, const char *const buf, const int n)
+{
+   const struct DisplayModel *const model = &Model[DisplayType];
+   char cup[16];
+   int len;
+   int r, c;
+   int i = 0;
+
+   while (i < n) {
+      if ((len = check_match(buf + i, n - i, model->home)) > 0) {
+         *row = 0;
+         *col = 0;
+      }
+      else if ((len = check_match(buf + i, n - i, model->cls)) > 0) {
+         memset(cell, ' ', MAXROWS * MAXCOLS);
+      }
+      else if ((len = check_match(buf + i, n - i, model->eol)) > 0) {
+         if (*row >= model->rows)
+            return (FALSE);
+
+         memset(&cell[*row][*col], ' ', MAXCOLS - *col);
+      }
+      else if ((len = check_match(buf + i, n - i, model->erase)) > 0) {
+         if (*row >= model->rows)
+            return (FALSE);
+
+         memset(cell[*row], ' ', MAXCOLS);
+      }
+      else if (buf[i] == ESC) {
+         len = 0;
+
+         /* Try every possible cursor position */
+         for (r = 0; (len == 0) && (model->cup != NULL) && (r < model->rows); r++) {
+            for (c = 0; (len == 0) && (c < MAXCOLS); c++) {
+               sprintf(cup, model->cup, r + 1, c + 1);
+
+               if ((len = check_match(buf + i, n - i, cup)) > 0) {
+                  *row = r;
+                  *col = c;
+               }
+            }
+         }
+
+         if ((len == 0) && (n - i >= 3) && (buf[i + 1] == 'R'))
+            len = 3;   // Select national character set
+
+         if (len == 0)
+            return (FALSE);
+      }
+      else if (buf[i] == '\r') {
+         *col = 0;
+         len = 1;
+      }
+      else if (buf[i] == '\n') {
+         if (++*row >= model->rows)
+            return (FALSE);
+
+         len = 1;
+      }
+      else if (((unsigned char)buf[i] >= ' ') && (*row < model->rows)) {
+         cell[*row][*col] = buf[i];
+
+         if (*col < MAXCOLS - 1)
+            ++*col;
+         else if (wrap) {
+            *col = 0;
+            ++*row;
+         }
+
+         len = 1;
+      }
+      else
+         return (FALSE);
+
+      i += len;
+   }
+
+   return (TRUE);
+}
+
+
+/* selftest --- check encoded updates for every pair of preset messages */
+
+static int selftest(void)
+{
+   const struct LayoutCache *grid;
+   struct Encoder enc;
+   char cell[2][MAXROWS][MAXCOLS];
+   int row[2], col[2];
+   int type, p, v, i, j, k, w, r;
+   int updates;
+   int failures = 0;
+
+   for (type = DISPLAY_BA63; type <= DISPLAY_IEE; type++) {
+      DisplayType = type;
+      Sentbytes = 0;
+      Fullbytes = 0;
+      updates = 0;
+
+      for (p = 0; Preset[p].which != 0; p++) {
+         /* Each preset as shipped, then with every alignment and wrap */
+         for (v = -1; v < 9; v++) {
+            preset_fill(&Bank[Frontbank], Preset[p].which);
+
+            for (i = 0; (v >= 0) && (i < MAXMSGS); i++) {
+               Bank[Frontbank].layout[i].align = v % 3;
+               Bank[Frontbank].layout[i].wrap = v / 3;
+               Bank[Frontbank].serial[i] = ++Serial;
+            }
+
+            /* Start with unknown rubbish on the display */
+            screen_reset(&Shadow);
+            memset(cell, '#', sizeof (cell));
+            row[0] = row[1] = col[0] = col[1] = 0;
+
+            for (i = 0; i < MAXMSGS; i++) {
+               for (j = 0; j < MAXMSGS; j++) {
+                  for (k = 0; k < 2; k++) {
+                     encode_message((k == 0) ? i : j, &enc);
+                     screen_feed(&Shadow, &Model[type], enc.buf, enc.len);
+                     grid = layout_message((k == 0) ? i : j);
+                     updates++;
+
+                     for (w = 0; w < 2; w++) {
+                        int ok = check_feed(cell[w], &row[w], &col[w], w, enc.buf, enc.len);
+
+                        for (r = 0; ok && (r < Model[type].rows); r++)
+                           if (memcmp(cell[w][r], grid->cell[r], MAXCOLS) != 0)
+                              ok = FALSE;
+
+                        if (!ok) {
+                           fprintf(stderr, "%s: preset %s, message %d, %s: wrong display\n",
+                                   Model[type].name, Preset[p].label, (k == 0) ? i + 1 : j + 1,
+                                   w ? "wrapping" : "not wrapping");
+                           failures++;
+                        }
+                     }
+                  }
+               }
+            }
+         }
+      }
+
+      printf("%s: %d updates, %ld bytes sent, full redraws would have sent %ld\n",
+             Model[type].name, updates, Sentbytes, Fullbytes);
+   }
+
+   printf("%d failures\n", failures);
+
+   return (failures);
 }
 
 
@@ -570,28 +1731,28 @@ int main(int argc, char *argv[])
 
 // printf("GTK V%d.%d.%d\n", GTK_MAJOR_VERSION, GTK_MINOR_VERSION, GTK_MICRO_VERSION);
    
+   /* Self-test needs neither a window nor a serial port */
+   if ((argc > 1) && (strcmp(argv[1], "-selftest") == 0))
+      return (selftest() ? 1 : 0);
+
    gtk_init(&argc, &argv);
 
    /* Create the main window */
    window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
 
-   i = 1;
-   
-   if (argc > 1) {
+   for (i = 1; i < argc; i++) {
       if (strcmp(argv[i], "-ba63") == 0) {
          DisplayType = DISPLAY_BA63;
-         i++;
       }
       else if (strcmp(argv[i], "-ba66") == 0) {
          DisplayType = DISPLAY_BA66;
-         i++;
       }
       else if (strcmp(argv[i], "-iee") == 0) {
          DisplayType = DISPLAY_IEE;
-         i++;
       }
-   }
-   else {
+      else if ((strcmp(argv[i], "-trace") == 0) && (i + 1 < argc)) {
+         trace_open(argv[++i]);
+      }
    }
    
    switch (DisplayType) {
@@ -717,11 +1878,19 @@ int main(int argc, char *argv[])
    /* Open the serial port connection to the display */
    Fd = openSerialPort("/dev/ttyUSB0", baud);
    
+   screen_reset(&Shadow);
+   
    ba63home();
    ba63cls();
    ba63charset(0);   // Select U.S. character set
    
    gtk_main();
 
+   trace_close();
+
+   if (Fullbytes > 0)
+      fprintf(stderr, "Sent %ld bytes to display, full redraws would have sent %ld\n",
+              Sentbytes, Fullbytes);
+
    return (0);
 }